@@ -16,6 +16,7 @@
 #include <unistd.h>
 #endif
 #include <sys/types.h>
+#include <pthread.h>
 
 #include <redland.h>
 #include <rdf_storage.h>
@@ -23,23 +24,92 @@
 
 #include "store.h"
 
+/* Storage feature holding reads to a snapshot while set to 1, for
+ * a query or session to see one consistent state of the store, with
+ * iterators reused between its finds. */
+#define ROCKSDB_FEATURE_SNAPSHOT "http://feature.librdf.org/rocksdb-snapshot"
+
+/* Size of the node cache, in entries.  Must be a power of 2. */
+#define ROCKSDB_NODE_CACHE_SIZE 4096
+
+/* A node cache entry: an encoded term and the node it decodes to. */
 typedef struct
+{
+    char* term;
+    size_t len;
+    librdf_node* node;
+} rocksdb_node_cache_entry;
+
+/* What each thread using the storage keeps to itself, so that threads
+ * can read at once without locking: nodes and URIs are reference
+ * counted without locks, and read scopes are per thread. */
+typedef struct rocksdb_thread_state_s
+{
+
+    struct rocksdb_thread_state_s* next;
+
+    /* The storage, so the state can be unlinked when the thread exits. */
+    struct librdf_storage_rocksdb_instance_s* context;
+
+    /* Non-zero while this thread's reads are held to a snapshot. */
+    int snapshot;
+
+    /* Datatype URIs of the typed literals the store encodes. */
+    librdf_uri* integer_type;
+    librdf_uri* float_type;
+    librdf_uri* datetime_type;
+
+    /* Direct-mapped cache of recently decoded terms.  Frequent terms,
+     * such as predicates and classes, are decoded once and the node
+     * shared by reference count. */
+    rocksdb_node_cache_entry* node_cache;
+
+} rocksdb_thread_state;
+
+typedef struct librdf_storage_rocksdb_instance_s
 {
 
     librdf_storage *storage;
 
     int is_new;
+
+    /* Load in bulk mode: triples are ingested as SST files on close. */
+    int bulk;
+
+    /* Non-zero while a transaction is active. */
+    int transaction;
   
     char *name;
     size_t name_len;
 
     implementation* impl;
 
+    /* Each thread's state, found through the key, and a list of them
+     * all to free.  The lock is only taken by a thread's first use, and
+     * when it exits. */
+    pthread_key_t thread_key;
+    int have_thread_key;
+    pthread_mutex_t threads_lock;
+    rocksdb_thread_state* threads;
+
+    /* The thread which created the storage.  Other threads may only
+     * read it if the world doesn't intern URIs, which raptor does
+     * without locking. */
+    pthread_t owner;
+    int uri_interning;
+    int refused;
+
 } librdf_storage_rocksdb_instance;
 
 typedef enum { SPO, POS, OSP } index_type;
 
+/* Number of statements add_statements puts in each write batch. */
+#define ROCKSDB_ADD_BATCH_SIZE 10000
+
 /* prototypes for local functions */
+static void rocksdb_free_thread_state(rocksdb_thread_state* state);
+static void rocksdb_thread_exit(void* arg);
+static int rocksdb_uri_interning(librdf_world* world);
 static int librdf_storage_rocksdb_init(
     librdf_storage* storage, const char *name, librdf_hash* options
 );
@@ -48,12 +118,14 @@ static int librdf_storage_rocksdb_open(
 );
 static int librdf_storage_rocksdb_close(librdf_storage* storage);
 static int librdf_storage_rocksdb_size(librdf_storage* storage);
+static int librdf_storage_rocksdb_sync(librdf_storage* storage);
 static int librdf_storage_rocksdb_add_statement(librdf_storage* storage, librdf_statement* statement);
 static int librdf_storage_rocksdb_add_statements(librdf_storage* storage, librdf_stream* statement_stream);
 static int librdf_storage_rocksdb_remove_statement(librdf_storage* storage, librdf_statement* statement);
 static int librdf_storage_rocksdb_contains_statement(librdf_storage* storage, librdf_statement* statement);
 static librdf_stream* librdf_storage_rocksdb_serialise(librdf_storage* storage);
 static librdf_stream* librdf_storage_rocksdb_find_statements(librdf_storage* storage, librdf_statement* statement);
+static librdf_stream* librdf_storage_rocksdb_find_statements_in_context(librdf_storage* storage, librdf_statement* statement, librdf_node* context_node);
 
 /* serialising implementing functions */
 static int rocksdb_results_stream_end_of_stream(void* context);
@@ -109,7 +181,8 @@ librdf_storage_rocksdb_init(librdf_storage* storage, const char *name,
   
     context->storage = storage;
     context->name_len = strlen(name);
-//    context->transaction = 0;
+    context->transaction = 0;
+    context->threads = 0;
 
     name_copy = LIBRDF_MALLOC(char*, context->name_len + 1);
     if(!name_copy) {
@@ -121,20 +194,122 @@ librdf_storage_rocksdb_init(librdf_storage* storage, const char *name,
     strcpy(name_copy, name);
     context->name = name_copy;
 
+    if (pthread_key_create(&context->thread_key, rocksdb_thread_exit) != 0) {
+	if(options)
+	    librdf_free_hash(options);
+	return 1;
+    }
+    context->have_thread_key = 1;
+    pthread_mutex_init(&context->threads_lock, 0);
+
+    context->owner = pthread_self();
+    context->uri_interning = rocksdb_uri_interning(storage->world);
+    context->refused = 0;
+
     if (librdf_hash_get_as_boolean(options, "new") > 0)
 	context->is_new = 1;
     else
 	context->is_new = 0;
 
+    if (librdf_hash_get_as_boolean(options, "bulk") > 0)
+	context->bulk = 1;
+    else
+	context->bulk = 0;
+
+    implementation_options impl_options;
+    memset(&impl_options, 0, sizeof(impl_options));
+    impl_options.is_new = context->is_new;
+
     // Add options here.
-    int sync = librdf_hash_get_as_boolean(options, "sync");
-    if (sync < 0) { sync = 0; }
+
+    /* Pipelined writes, for loaders writing from many threads. */
+    if (librdf_hash_get_as_boolean(options, "pipelined-writes") > 0)
+	impl_options.pipelined_writes = 1;
+
+    /* sync='yes' is the same as durability='sync'. */
+    if (librdf_hash_get_as_boolean(options, "sync") > 0)
+	impl_options.durability = DURABILITY_SYNC;
+
+    char* durability = librdf_hash_get(options, "durability");
+    if (durability) {
+	if (strcmp(durability, "sync") == 0)
+	    impl_options.durability = DURABILITY_SYNC;
+	else if (strcmp(durability, "group") == 0)
+	    impl_options.durability = DURABILITY_GROUP;
+	else if (strcmp(durability, "wal") == 0)
+	    impl_options.durability = DURABILITY_WAL;
+	else if (strcmp(durability, "none") == 0)
+	    impl_options.durability = DURABILITY_NONE;
+	else {
+	    fprintf(stderr, "Unknown durability mode: %s\n", durability);
+	    LIBRDF_FREE(char*, durability);
+	    librdf_free_hash(options);
+	    return 1;
+	}
+	LIBRDF_FREE(char*, durability);
+    }
+
+    char* mode = librdf_hash_get(options, "mode");
+    if (mode) {
+	if (strcmp(mode, "primary") == 0)
+	    impl_options.mode = OPEN_PRIMARY;
+	else if (strcmp(mode, "read-only") == 0)
+	    impl_options.mode = OPEN_READ_ONLY;
+	else if (strcmp(mode, "secondary") == 0)
+	    impl_options.mode = OPEN_SECONDARY;
+	else {
+	    fprintf(stderr, "Unknown open mode: %s\n", mode);
+	    LIBRDF_FREE(char*, mode);
+	    librdf_free_hash(options);
+	    return 1;
+	}
+	LIBRDF_FREE(char*, mode);
+    }
+
+    /* A secondary's catch-up interval, in milliseconds. */
+    long catch_up_interval =
+	librdf_hash_get_as_long(options, "catch-up-interval");
+    if (catch_up_interval > 0)
+	impl_options.catch_up_interval = (unsigned int) catch_up_interval;
+
+    /* Group mode's WAL sync interval, in milliseconds. */
+    long sync_interval = librdf_hash_get_as_long(options, "sync-interval");
+    if (sync_interval > 0)
+	impl_options.sync_interval = (unsigned int) sync_interval;
+
+    /* Block cache size, in megabytes. */
+    long cache_size = librdf_hash_get_as_long(options, "cache-size");
+    if (cache_size > 0)
+	impl_options.cache_size = (size_t) cache_size * 1024 * 1024;
+
+    /* RocksDB's own settings, which the store copies. */
+    char* options_file = librdf_hash_get(options, "options-file");
+    char* db_options = librdf_hash_get(options, "db-options");
+    char* cf_options = librdf_hash_get(options, "cf-options");
+    char* family_options = librdf_hash_get(options, "column-families");
+    char* secondary_path = librdf_hash_get(options, "secondary-path");
+    impl_options.options_file = options_file;
+    impl_options.db_options = db_options;
+    impl_options.cf_options = cf_options;
+    impl_options.family_options = family_options;
+    impl_options.secondary_path = secondary_path;
 
     /* no more options, might as well free them now */
     if(options)
 	librdf_free_hash(options);
 
-    context->impl = implementation_new(context->name, sync, context->is_new);
+    context->impl = implementation_new(context->name, &impl_options);
+
+    if (options_file)
+	LIBRDF_FREE(char*, options_file);
+    if (db_options)
+	LIBRDF_FREE(char*, db_options);
+    if (cf_options)
+	LIBRDF_FREE(char*, cf_options);
+    if (family_options)
+	LIBRDF_FREE(char*, family_options);
+    if (secondary_path)
+	LIBRDF_FREE(char*, secondary_path);
 
     return 0;
 
@@ -149,11 +324,25 @@ librdf_storage_rocksdb_terminate(librdf_storage* storage)
 
     context = (librdf_storage_rocksdb_instance*)storage->instance;
 
-    context->impl->free(context->impl);
-  
     if (context == NULL)
 	return;
 
+    if (context->impl)
+	context->impl->free(context->impl);
+
+    /* The key goes first, so no thread exiting now frees a state too. */
+    if (context->have_thread_key)
+	pthread_key_delete(context->thread_key);
+
+    while (context->threads) {
+	rocksdb_thread_state* state = context->threads;
+	context->threads = state->next;
+	rocksdb_free_thread_state(state);
+    }
+
+    if (context->have_thread_key)
+	pthread_mutex_destroy(&context->threads_lock);
+
     if(context->name)
 	LIBRDF_FREE(char*, context->name);
   
@@ -264,7 +453,13 @@ librdf_storage_rocksdb_open(librdf_storage* storage, librdf_model* model)
 
     context = (librdf_storage_rocksdb_instance*)storage->instance;
 
-    return context->impl->open(context->impl);
+    if (context->impl->open(context->impl) < 0)
+	return -1;
+
+    if (context->bulk)
+	return context->impl->begin_bulk(context->impl);
+
+    return 0;
 
 }
 
@@ -284,8 +479,23 @@ librdf_storage_rocksdb_close(librdf_storage* storage)
     librdf_storage_rocksdb_instance* context;
     context = (librdf_storage_rocksdb_instance*)storage->instance;
 
+    int ret = 0;
+
+    /* Bulk loaded triples only reach the store here. */
+    if (context->bulk)
+	ret = context->impl->end_bulk(context->impl);
+
+    /* The store ends any read scopes still open. */
+    pthread_mutex_lock(&context->threads_lock);
+    rocksdb_thread_state* state;
+    for(state = context->threads; state; state = state->next)
+	state->snapshot = 0;
+    pthread_mutex_unlock(&context->threads_lock);
+
     context->impl->close(context->impl);
 
+    return ret;
+
 }
 
 static int
@@ -299,6 +509,25 @@ librdf_storage_rocksdb_size(librdf_storage* storage)
 	
 }
 
+/**
+ * librdf_storage_rocksdb_sync:
+ * @storage: the storage
+ *
+ * Make every write so far durable, whatever the durability mode.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_storage_rocksdb_sync(librdf_storage* storage)
+{
+
+    librdf_storage_rocksdb_instance* context;
+    context = (librdf_storage_rocksdb_instance*)storage->instance;
+
+    return context->impl->sync(context->impl);
+
+}
+
 static int
 librdf_storage_rocksdb_add_statement(librdf_storage* storage, 
                                     librdf_statement* statement)
@@ -317,6 +546,13 @@ librdf_storage_rocksdb_add_statements(librdf_storage* storage,
     librdf_storage_rocksdb_instance* context;
     context = (librdf_storage_rocksdb_instance*)storage->instance;
 
+    int ret = 0;
+    int count = 0;
+
+    /* Statements are written in batches, each batch in a single write. */
+    if (context->impl->begin_batch(context->impl) < 0)
+	return -1;
+
     for(; !librdf_stream_end(statement_stream);
 	librdf_stream_next(statement_stream)) {
 
@@ -336,17 +572,39 @@ librdf_storage_rocksdb_add_statements(librdf_storage* storage,
 	char* c;
 	statement_helper(storage, statement, context_node, &s, &p, &o, &c);
 
-	int ret = context->impl->add(context->impl, s, p, o, c);
+	ret = context->impl->add(context->impl, s, p, o, c);
 
 	free(s);
 	free(p);
 	free(o);
 	free(c);
 
-	if (ret < 0) return -1;
+	if (ret < 0) break;
+
+	if (++count == ROCKSDB_ADD_BATCH_SIZE) {
+	    count = 0;
+	    if (context->impl->commit_batch(context->impl) < 0 ||
+		context->impl->begin_batch(context->impl) < 0)
+		return -1;
+	}
 
     }
-    
+
+    /* A failed add discards the rest of its batch, so each batch is
+     * written whole or not at all, and earlier batches stay written.
+     * Within a transaction the batch is the transaction's, and what
+     * was added stays in it for its commit or rollback. */
+    if (ret < 0) {
+	if (context->transaction)
+	    context->impl->commit_batch(context->impl);
+	else
+	    context->impl->rollback_batch(context->impl);
+	return -1;
+    }
+
+    if (context->impl->commit_batch(context->impl) < 0)
+	return -1;
+
     return 0;
 
 }
@@ -400,6 +658,9 @@ typedef struct {
     librdf_storage *storage;
     librdf_storage_rocksdb_instance* rocksdb_context;
 
+    /* Non-zero if the stream holds a reference to the storage. */
+    int referenced;
+
     // FIXME: Needed?
     librdf_statement *statement;
     librdf_node* context;
@@ -408,75 +669,247 @@ typedef struct {
 
 } rocksdb_results_stream;
 
+/* Streams and iterators made by the thread which created the storage
+ * hold a reference to it, as librdf's own storages' do.  librdf counts
+ * references without locking, so those made by other threads don't,
+ * and must be freed before the storage is.  Returns non-zero if a
+ * reference was taken. */
+static int
+rocksdb_storage_add_reference(librdf_storage_rocksdb_instance* context)
+{
+    if (!pthread_equal(pthread_self(), context->owner))
+	return 0;
+    librdf_storage_add_reference(context->storage);
+    return 1;
+}
+
+/* Whether the world interns URIs: if it does, the same string gives
+ * the same URI object. */
+static int
+rocksdb_uri_interning(librdf_world* world)
+{
+
+    raptor_world* rworld = librdf_world_get_raptor(world);
+    const unsigned char* probe =
+	(const unsigned char*) "http://feature.librdf.org/rocksdb-probe";
+
+    raptor_uri* u1 = raptor_new_uri(rworld, probe);
+    raptor_uri* u2 = raptor_new_uri(rworld, probe);
+
+    int interning = u1 && u1 == u2;
+
+    if (u1) raptor_free_uri(u1);
+    if (u2) raptor_free_uri(u2);
+
+    return interning;
+
+}
+
+static void
+rocksdb_free_thread_state(rocksdb_thread_state* state)
+{
+
+    if (state->node_cache) {
+	int i;
+	for(i = 0; i < ROCKSDB_NODE_CACHE_SIZE; i++) {
+	    if (state->node_cache[i].node)
+		librdf_free_node(state->node_cache[i].node);
+	    if (state->node_cache[i].term)
+		free(state->node_cache[i].term);
+	}
+	LIBRDF_FREE(rocksdb_node_cache_entry*, state->node_cache);
+    }
+
+    if (state->integer_type)
+	librdf_free_uri(state->integer_type);
+    if (state->float_type)
+	librdf_free_uri(state->float_type);
+    if (state->datetime_type)
+	librdf_free_uri(state->datetime_type);
+
+    LIBRDF_FREE(rocksdb_thread_state*, state);
+
+}
+
+/* Frees a thread's state as it exits.  The store ends any read scope
+ * the thread left open itself. */
+static void
+rocksdb_thread_exit(void* arg)
+{
+
+    rocksdb_thread_state* state = (rocksdb_thread_state*) arg;
+    librdf_storage_rocksdb_instance* context = state->context;
+    rocksdb_thread_state** at;
+
+    pthread_mutex_lock(&context->threads_lock);
+    for(at = &context->threads; *at; at = &(*at)->next)
+	if (*at == state) {
+	    *at = state->next;
+	    break;
+	}
+    pthread_mutex_unlock(&context->threads_lock);
+
+    rocksdb_free_thread_state(state);
+
+}
+
+/* Returns the calling thread's state, creating it on first use, or
+ * NULL if it can't be created.  It lasts until the thread exits or the
+ * storage is freed, so a thread's nodes must be freed before then. */
+static rocksdb_thread_state*
+rocksdb_thread(librdf_storage_rocksdb_instance* context)
+{
+
+    rocksdb_thread_state* state;
+    librdf_world* world = context->storage->world;
+
+    state = (rocksdb_thread_state*) pthread_getspecific(context->thread_key);
+    if (state)
+	return state;
+
+    /* Nodes made on other threads would share interned URIs. */
+    if (context->uri_interning &&
+	!pthread_equal(pthread_self(), context->owner)) {
+	pthread_mutex_lock(&context->threads_lock);
+	if (!context->refused)
+	    fprintf(stderr, "rocksdb storage: reading from more than one "
+		    "thread needs raptor URI interning turned off\n");
+	context->refused = 1;
+	pthread_mutex_unlock(&context->threads_lock);
+	return 0;
+    }
+
+    state = LIBRDF_CALLOC(rocksdb_thread_state*, 1, sizeof(*state));
+    if (!state)
+	return 0;
+
+    state->context = context;
+
+    state->integer_type =
+	librdf_new_uri(world,
+		       (const unsigned char*) "http://www.w3.org/2001/XMLSchema#integer");
+    state->float_type =
+	librdf_new_uri(world,
+		       (const unsigned char*) "http://www.w3.org/2001/XMLSchema#float");
+    state->datetime_type =
+	librdf_new_uri(world,
+		       (const unsigned char*) "http://www.w3.org/2001/XMLSchema#dateTime");
+
+    state->node_cache =
+	LIBRDF_CALLOC(rocksdb_node_cache_entry*, ROCKSDB_NODE_CACHE_SIZE,
+		      sizeof(rocksdb_node_cache_entry));
+
+    if (!state->integer_type || !state->float_type ||
+	!state->datetime_type || !state->node_cache ||
+	pthread_setspecific(context->thread_key, state) != 0) {
+	rocksdb_free_thread_state(state);
+	return 0;
+    }
+
+    pthread_mutex_lock(&context->threads_lock);
+    state->next = context->threads;
+    context->threads = state;
+    pthread_mutex_unlock(&context->threads_lock);
+
+    return state;
+
+}
+
+/* Terms from the store are counted, and not NUL-terminated. */
 static
-librdf_node* node_constructor_helper(librdf_world* world, const char* t,
-				     size_t len)
+librdf_node* node_constructor_helper(librdf_storage_rocksdb_instance* context,
+				     rocksdb_thread_state* state,
+				     const char* t, size_t len)
 {
 
-    librdf_node* o;
+    librdf_world* world = context->storage->world;
+    librdf_uri* dt;
 
-    if ((strlen(t) < 2) || (t[1] != ':')) {
+    if ((len < 2) || (t[1] != ':')) {
 	fprintf(stderr, "node_constructor_helper called on invalid term\n");
 	return 0;
     }
 
-    if (t[0] == 'u') {
- 	o = librdf_new_node_from_counted_uri_string(world,
-						    (unsigned char*) t + 2,
-						    len - 2);
-	return o;
-    }
+    switch (t[0]) {
 
-    if (t[0] == 's') {
-	o = librdf_new_node_from_typed_counted_literal(world,
+    case 'u':
+ 	return librdf_new_node_from_counted_uri_string(world,
 						       (unsigned char*) t + 2,
-						       len - 2, 0, 0, 0);
-	return o;
-    }
+						       len - 2);
 
+    case 'b':
+	return librdf_new_node_from_counted_blank_identifier(world,
+							     (unsigned char*) t + 2,
+							     len - 2);
 
-    if (t[0] == 'i') {
-	librdf_uri* dt =
-	    librdf_new_uri(world,
-			   "http://www.w3.org/2001/XMLSchema#integer");
-	if (dt == 0)
-	    return 0;
+    case 'i':
+	dt = state->integer_type;
+	break;
 
-	o = librdf_new_node_from_typed_counted_literal(world, t + 2, len - 2,
-						       0, 0, dt);
-	librdf_free_uri(dt);
-	return o;
-    }
-    
-    if (t[0] == 'f') {
-	librdf_uri* dt =
-	    librdf_new_uri(world,
-			   "http://www.w3.org/2001/XMLSchema#float");
-	if (dt == 0)
-	    return 0;
+    case 'f':
+	dt = state->float_type;
+	break;
 
-	o = librdf_new_node_from_typed_counted_literal(world, t + 2, len - 2,
-						       0, 0, dt);
-	librdf_free_uri(dt);
-	return o;
-    }
+    case 'd':
+	dt = state->datetime_type;
+	break;
 
-    if (t[0] == 'd') {
-	librdf_uri* dt =
-	    librdf_new_uri(world,
-			   "http://www.w3.org/2001/XMLSchema#dateTime");
-	if (dt == 0)
-	    return 0;
+    default:
+	dt = 0;
+	break;
 
-	o = librdf_new_node_from_typed_counted_literal(world, t + 2, len - 2,
-						       0, 0, dt);
-	librdf_free_uri(dt);
-	return o;
-    }    
+    }
 
     return librdf_new_node_from_typed_counted_literal(world,
 						      (unsigned char*) t + 2,
-						      len - 2, 0, 0, 0);
+						      len - 2, 0, 0, dt);
+
+}
+
+/* Returns a new reference to the node for a term, from the node cache
+ * where possible. */
+static
+librdf_node* node_cache_helper(librdf_storage_rocksdb_instance* context,
+			       const char* t, size_t len)
+{
+
+    rocksdb_thread_state* state = rocksdb_thread(context);
+    if (state == 0)
+	return 0;
+
+    /* FNV-1a */
+    unsigned int hash = 2166136261u;
+    size_t i;
+    for(i = 0; i < len; i++) {
+	hash ^= (unsigned char) t[i];
+	hash *= 16777619u;
+    }
+
+    rocksdb_node_cache_entry* entry =
+	&state->node_cache[hash & (ROCKSDB_NODE_CACHE_SIZE - 1)];
+
+    if (entry->node && entry->len == len && memcmp(entry->term, t, len) == 0)
+	return librdf_new_node_from_node(entry->node);
+
+    librdf_node* node = node_constructor_helper(context, state, t, len);
+    if (node == 0)
+	return 0;
+
+    char* term = malloc(len);
+    if (term == 0)
+	return node;
+
+    if (entry->node)
+	librdf_free_node(entry->node);
+    if (entry->term)
+	free(entry->term);
+
+    memcpy(term, t, len);
+    entry->term = term;
+    entry->len = len;
+    entry->node = librdf_new_node_from_node(node);
+
+    return node;
 
 }
 
@@ -533,9 +966,9 @@ rocksdb_results_stream_get_statement(void* context, int flags)
 	}
 
 	librdf_node* sn, * pn, * on;
-	sn = node_constructor_helper(scontext->storage->world, s, s_len);
-	pn = node_constructor_helper(scontext->storage->world, p, p_len);
-	on = node_constructor_helper(scontext->storage->world, o, o_len);
+	sn = node_cache_helper(scontext->rocksdb_context, s, s_len);
+	pn = node_cache_helper(scontext->rocksdb_context, p, p_len);
+	on = node_cache_helper(scontext->rocksdb_context, o, o_len);
 
 	if (sn == 0 || pn == 0 || on == 0) {
 	    if (sn) librdf_free_node(sn);
@@ -572,7 +1005,7 @@ rocksdb_results_stream_finished(void* context)
     if (scontext->stream)
 	scontext->stream->free(scontext->stream);
 	
-    if(scontext->storage)
+    if(scontext->referenced)
 	librdf_storage_remove_reference(scontext->storage);
 
     // FIXME: Are we using statement?
@@ -586,6 +1019,103 @@ rocksdb_results_stream_finished(void* context)
 
 }
 
+/* Iterates over the distinct terms of the store, as nodes. */
+typedef struct {
+
+    librdf_storage *storage;
+    librdf_storage_rocksdb_instance* rocksdb_context;
+
+    /* Non-zero if the iterator holds a reference to the storage. */
+    int referenced;
+
+    implementation_terms* terms;
+
+    /* The node last returned, owned by the iterator. */
+    librdf_node* node;
+
+} rocksdb_terms_iterator;
+
+static int
+rocksdb_terms_iterator_is_end(void* context)
+{
+
+    rocksdb_terms_iterator* icontext;
+    icontext = (rocksdb_terms_iterator*)context;
+
+    return icontext->terms->at_end(icontext->terms);
+
+}
+
+static int
+rocksdb_terms_iterator_next(void* context)
+{
+
+    rocksdb_terms_iterator* icontext;
+    icontext = (rocksdb_terms_iterator*)context;
+
+    return icontext->terms->next(icontext->terms);
+
+}
+
+static void*
+rocksdb_terms_iterator_get(void* context, int flags)
+{
+
+    rocksdb_terms_iterator* icontext;
+    const char* t;
+    size_t t_len;
+
+    icontext = (rocksdb_terms_iterator*)context;
+
+    switch(flags) {
+
+    case LIBRDF_ITERATOR_GET_METHOD_GET_OBJECT:
+
+	if (icontext->node) {
+	    librdf_free_node(icontext->node);
+	    icontext->node = 0;
+	}
+
+	if (icontext->terms->get(icontext->terms, &t, &t_len) < 0)
+	    return NULL;
+
+	icontext->node =
+	    node_cache_helper(icontext->rocksdb_context, t, t_len);
+
+	return icontext->node;
+
+    case LIBRDF_ITERATOR_GET_METHOD_GET_CONTEXT:
+	return NULL;
+
+    default:
+	librdf_log(icontext->storage->world,
+		   0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+		   "Unknown iterator method flag %d", flags);
+	return NULL;
+    }
+
+}
+
+static void
+rocksdb_terms_iterator_finished(void* context)
+{
+
+    rocksdb_terms_iterator* icontext;
+    icontext = (rocksdb_terms_iterator*)context;
+
+    if (icontext->terms)
+	icontext->terms->free(icontext->terms);
+
+    if (icontext->node)
+	librdf_free_node(icontext->node);
+
+    if(icontext->referenced)
+	librdf_storage_remove_reference(icontext->storage);
+
+    LIBRDF_FREE(rocksdb_terms_iterator, icontext);
+
+}
+
 static librdf_stream*
 librdf_storage_rocksdb_serialise(librdf_storage* storage)
 {
@@ -622,6 +1152,30 @@ static librdf_stream*
 librdf_storage_rocksdb_find_statements(librdf_storage* storage,
 				       librdf_statement* statement)
 {
+
+    return librdf_storage_rocksdb_find_statements_in_context(storage,
+							     statement,
+							     NULL);
+
+}
+
+/**
+ * librdf_storage_rocksdb_find_statements_in_context:
+ * @storage: the storage
+ * @statement: the statement to match
+ * @context_node: context node, or NULL for all graphs
+ *
+ * Return a stream of statements in a context matching the given
+ * statement.  With a context, only that graph's entries in the
+ * context-leading index are scanned.
+ * 
+ * Return value: a #librdf_stream or NULL on failure
+ **/
+static librdf_stream*
+librdf_storage_rocksdb_find_statements_in_context(librdf_storage* storage,
+						  librdf_statement* statement,
+						  librdf_node* context_node)
+{
   
     librdf_storage_rocksdb_instance* context;
     rocksdb_results_stream* scontext;
@@ -632,43 +1186,54 @@ librdf_storage_rocksdb_find_statements(librdf_storage* storage,
     char* c;
 
     context = (librdf_storage_rocksdb_instance*)storage->instance;
+
+    /* The stream's nodes are made with this thread's state. */
+    if (!rocksdb_thread(context))
+	return NULL;
     
-    statement_helper(storage, statement, 0, &s, &p, &o, &c);
+    statement_helper(storage, statement, context_node, &s, &p, &o, &c);
 
+#ifdef DEBUG
+    fprintf(stderr, "Query: ");
+    if (s)
+      fprintf(stderr, "s=%s ", s);
+    if (p)
+      fprintf(stderr, "p=%s ", p);
+    if (o)
+      fprintf(stderr, "o=%s ", o);
+    if (c)
+      fprintf(stderr, "c=%s ", c);
+    fprintf(stderr, "\n");
+#endif
+ 
     implementation_stream* strm = context->impl->new_stream(
 	context->impl,
 	s, p, o, c);
 
-    if (strm == NULL) {
-	free(s);
-	free(p);
-	free(o);
-	free(c);
+    free(s);
+    free(p);
+    free(o);
+    free(c);
+
+    if (strm == NULL)
 	return NULL;
-    }
 
     scontext =
 	LIBRDF_CALLOC(rocksdb_results_stream*, 1, sizeof(*scontext));
-    if(!scontext)
+    if(!scontext) {
+	strm->free(strm);
 	return NULL;
+    }
 
     scontext->storage = storage;
-    librdf_storage_add_reference(scontext->storage);
+    scontext->referenced = rocksdb_storage_add_reference(context);
 
     scontext->rocksdb_context = context;
     scontext->stream = strm;
 
-#ifdef DEBUG
-    fprintf(stderr, "Query: ");
-    if (s)
-      fprintf(stderr, "s=%s ", s);
-    if (p)
-      fprintf(stderr, "p=%s ", p);
-    if (o)
-      fprintf(stderr, "o=%s ", o);
-    fprintf(stderr, "\n");
-#endif
- 
+    if (context_node)
+	scontext->context = librdf_new_node_from_node(context_node);
+
     stream =
 	librdf_new_stream(storage->world,
 			  (void*)scontext,
@@ -756,19 +1321,41 @@ librdf_storage_rocksdb_context_remove_statement(librdf_storage* storage,
     free(o);
     free(c);
 
-    return 0;
+    return ret;
 
 }
 
 
+/**
+ * librdf_storage_rocksdb_context_remove_statements:
+ * @storage: #librdf_storage object
+ * @context_node: #librdf_node object
+ *
+ * Remove all statements from a storage context.  The graph's entries
+ * in the context-leading index are dropped as key ranges.
+ * 
+ * Return value: non 0 on failure
+ **/
 static  int
 librdf_storage_rocksdb_context_remove_statements(librdf_storage* storage, 
                                                 librdf_node* context_node)
 {
 
-    //FIXME: Not implemented.
+    librdf_storage_rocksdb_instance* context; 
+    context = (librdf_storage_rocksdb_instance*)storage->instance;
+
+    if (context_node == NULL)
+	return -1;
+
+    char* c = node_helper(storage, context_node);
+    if (c == 0)
+	return -1;
 
-    return -1;
+    int ret = context->impl->remove_context(context->impl, c);
+
+    free(c);
+
+    return ret;
 
 }
 
@@ -786,9 +1373,17 @@ librdf_storage_rocksdb_context_serialise(librdf_storage* storage,
                                         librdf_node* context_node) 
 {
 
-    //FIXME: Not implemented.
+    librdf_statement* stmt = 
+	    librdf_new_statement_from_nodes(storage->world,
+					    0, 0, 0);
 
-    return 0;
+    librdf_stream* strm =
+	librdf_storage_rocksdb_find_statements_in_context(storage, stmt,
+							  context_node);
+
+    librdf_free_statement(stmt);
+
+    return strm;
 
 }
 
@@ -803,9 +1398,47 @@ librdf_storage_rocksdb_context_serialise(librdf_storage* storage,
 static librdf_iterator*
 librdf_storage_rocksdb_get_contexts(librdf_storage* storage) 
 {
-    // FIXME: Not implemented.
 
-    return 0;
+    librdf_storage_rocksdb_instance* context;
+    rocksdb_terms_iterator* icontext;
+    librdf_iterator* iterator;
+
+    context = (librdf_storage_rocksdb_instance*)storage->instance;
+
+    if (!rocksdb_thread(context))
+	return NULL;
+
+    implementation_terms* terms =
+	context->impl->distinct_terms(context->impl, TERM_C);
+    if (terms == NULL)
+	return NULL;
+
+    icontext =
+	LIBRDF_CALLOC(rocksdb_terms_iterator*, 1, sizeof(*icontext));
+    if(!icontext) {
+	terms->free(terms);
+	return NULL;
+    }
+
+    icontext->storage = storage;
+    icontext->referenced = rocksdb_storage_add_reference(context);
+
+    icontext->rocksdb_context = context;
+    icontext->terms = terms;
+
+    iterator =
+	librdf_new_iterator(storage->world,
+			    (void*)icontext,
+			    &rocksdb_terms_iterator_is_end,
+			    &rocksdb_terms_iterator_next,
+			    &rocksdb_terms_iterator_get,
+			    &rocksdb_terms_iterator_finished);
+    if(!iterator) {
+	rocksdb_terms_iterator_finished((void*)icontext);
+	return NULL;
+    }
+
+    return iterator;
 
 }
 
@@ -834,16 +1467,93 @@ librdf_storage_rocksdb_get_feature(librdf_storage* storage, librdf_uri* feature)
     if(!uri_string)
 	return NULL;
 
-    // FIXME: This is a lie.  Contexts not implemented. :-/
     if(!strcmp((const char*)uri_string, LIBRDF_MODEL_FEATURE_CONTEXTS)) {
 	return librdf_new_node_from_typed_literal(storage->world,
 						  (const unsigned char*)"1",
 						  NULL, NULL);
     }
 
+    if(!strcmp((const char*)uri_string, ROCKSDB_FEATURE_SNAPSHOT)) {
+	librdf_storage_rocksdb_instance* context;
+	rocksdb_thread_state* state;
+	context = (librdf_storage_rocksdb_instance*)storage->instance;
+	state = rocksdb_thread(context);
+	if(!state)
+	    return NULL;
+	return librdf_new_node_from_typed_literal(storage->world,
+						  (const unsigned char*)
+						  (state->snapshot ?
+						   "1" : "0"),
+						  NULL, NULL);
+    }
+
     return NULL;
 }
 
+/**
+ * librdf_storage_rocksdb_set_feature:
+ * @storage: #librdf_storage object
+ * @feature: #librdf_uri feature property
+ * @value: #librdf_node feature property value
+ *
+ * Set the value of a storage feature.  Setting the snapshot feature
+ * to 1 holds the calling thread's reads to the current state of the
+ * store until it sets it to 0.
+ * 
+ * Return value: non 0 on failure (negative if no such feature)
+ **/
+static int
+librdf_storage_rocksdb_set_feature(librdf_storage* storage,
+				   librdf_uri* feature,
+				   librdf_node* value)
+{
+
+    librdf_storage_rocksdb_instance* context;
+    rocksdb_thread_state* state;
+    unsigned char *uri_string;
+    const char* v;
+    int on;
+    int ret;
+
+    context = (librdf_storage_rocksdb_instance*)storage->instance;
+
+    if(!feature)
+	return -1;
+
+    uri_string = librdf_uri_as_string(feature);
+    if(!uri_string)
+	return -1;
+
+    if(strcmp((const char*)uri_string, ROCKSDB_FEATURE_SNAPSHOT))
+	return -1;
+
+    if(!value || librdf_node_get_type(value) != LIBRDF_NODE_TYPE_LITERAL)
+	return 1;
+
+    v = (const char*)librdf_node_get_literal_value(value);
+    on = (strcmp(v, "1") == 0 || strcmp(v, "yes") == 0);
+
+    state = rocksdb_thread(context);
+    if (!state)
+	return 1;
+
+    if (on == state->snapshot)
+	return 0;
+
+    if (on)
+	ret = context->impl->begin_read(context->impl);
+    else
+	ret = context->impl->end_read(context->impl);
+
+    if (ret < 0)
+	return 1;
+
+    state->snapshot = on;
+
+    return 0;
+
+}
+
 
 /**
  * librdf_storage_rocksdb_transaction_start:
@@ -857,22 +1567,21 @@ librdf_storage_rocksdb_get_feature(librdf_storage* storage, librdf_uri* feature)
 static int
 librdf_storage_rocksdb_transaction_start(librdf_storage *storage)
 {
-#ifdef BROKEN
 
     librdf_storage_rocksdb_instance* context;
 
     context = (librdf_storage_rocksdb_instance*)storage->instance;
 
-    /* If already have a trasaction, silently do nothing. */
     if (context->transaction)
-	return 0;
+	return -1;
 
-    context->transaction = rocksdb_elements_create();
-    if (context->transaction == 0)
+    /* Writes go to an indexed batch until commit, and reads see them. */
+    if (context->impl->begin_batch(context->impl) < 0)
 	return -1;
 
+    context->transaction = 1;
+
     return 0;
-#endif
 
 }
 
@@ -890,7 +1599,6 @@ static int
 librdf_storage_rocksdb_transaction_commit(librdf_storage *storage)
 {
 
-#ifdef BROKEN
     librdf_storage_rocksdb_instance* context;
 
     context = (librdf_storage_rocksdb_instance*)storage->instance;
@@ -898,17 +1606,14 @@ librdf_storage_rocksdb_transaction_commit(librdf_storage *storage)
     if (context->transaction == 0)
 	return -1;
 
-    int ret = rocksdb_add_elements(context->comms, context->transaction);
-
-    rocksdb_elements_free(context->transaction);
-
     context->transaction = 0;
 
-    if (ret < 0) return -1;
+    /* The whole transaction is applied in one atomic write. */
+    if (context->impl->commit_batch(context->impl) < 0)
+	return -1;
 
     return 0;
 
-#endif
 }
 
 
@@ -924,21 +1629,20 @@ librdf_storage_rocksdb_transaction_commit(librdf_storage *storage)
 static int
 librdf_storage_rocksdb_transaction_rollback(librdf_storage *storage)
 {
-#ifdef BROKEN
 
     librdf_storage_rocksdb_instance* context;
 
     context = (librdf_storage_rocksdb_instance*)storage->instance;
 
-    if (context->transaction)
+    if (context->transaction == 0)
 	return -1;
 
-    rocksdb_elements_free(context->transaction);
-
     context->transaction = 0;
 
+    if (context->impl->rollback_batch(context->impl) < 0)
+	return -1;
+
     return 0;
-#endif
 
 }
 
@@ -954,18 +1658,21 @@ librdf_storage_rocksdb_register_factory(librdf_storage_factory *factory)
     factory->open               = librdf_storage_rocksdb_open;
     factory->close              = librdf_storage_rocksdb_close;
     factory->size               = librdf_storage_rocksdb_size;
+    factory->sync               = librdf_storage_rocksdb_sync;
     factory->add_statement      = librdf_storage_rocksdb_add_statement;
     factory->add_statements     = librdf_storage_rocksdb_add_statements;
     factory->remove_statement   = librdf_storage_rocksdb_remove_statement;
     factory->contains_statement = librdf_storage_rocksdb_contains_statement;
     factory->serialise          = librdf_storage_rocksdb_serialise;
     factory->find_statements    = librdf_storage_rocksdb_find_statements;
+    factory->find_statements_in_context = librdf_storage_rocksdb_find_statements_in_context;
     factory->context_add_statement    = librdf_storage_rocksdb_context_add_statement;
     factory->context_remove_statement = librdf_storage_rocksdb_context_remove_statement;
     factory->context_remove_statements = librdf_storage_rocksdb_context_remove_statements;
     factory->context_serialise        = librdf_storage_rocksdb_context_serialise;
     factory->get_contexts             = librdf_storage_rocksdb_get_contexts;
     factory->get_feature              = librdf_storage_rocksdb_get_feature;
+    factory->set_feature              = librdf_storage_rocksdb_set_feature;
     factory->transaction_start        = librdf_storage_rocksdb_transaction_start;
     factory->transaction_commit       = librdf_storage_rocksdb_transaction_commit;
     factory->transaction_rollback     = librdf_storage_rocksdb_transaction_rollback;
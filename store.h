@@ -1,15 +1,100 @@
 
+#include <stdint.h>
+
+typedef enum { TERM_S, TERM_P, TERM_O, TERM_C } term_part;
+
+/* How writes are made durable.  DURABILITY_WAL writes the WAL without
+ * syncing it, DURABILITY_SYNC syncs it on every write, DURABILITY_GROUP
+ * syncs it in the background within a set interval of a write, and
+ * DURABILITY_NONE doesn't write it, so unflushed writes are lost in a
+ * crash. */
+typedef enum {
+    DURABILITY_WAL, DURABILITY_SYNC, DURABILITY_GROUP, DURABILITY_NONE
+} durability_mode;
+
+/* How the store is opened.  OPEN_PRIMARY reads and writes, and only one
+ * process may open a store so.  OPEN_READ_ONLY reads the store as it
+ * was when opened.  OPEN_SECONDARY follows a primary in another process,
+ * catching up with its writes periodically.  Any number of processes
+ * may open a store read-only or as secondaries. */
+typedef enum { OPEN_PRIMARY, OPEN_READ_ONLY, OPEN_SECONDARY } open_mode;
+
+/* Any number of threads may read a store at once, while one thread at
+ * a time writes.  Only the writing thread sees its open batch and the
+ * terms it allocated in it.  Read scopes and their iterators belong to
+ * the thread which began them, and every thread must end its scopes,
+ * and free its streams, before the store is closed.  Streams and term
+ * iterators opened in a batch end when it is committed or rolled
+ * back. */
 struct implementation_t {
     void (*close)(struct implementation_t*);
     void (*free)(struct implementation_t*);
     int (*open)(struct implementation_t*);
     int (*size)(struct implementation_t*);
     int (*add)(struct implementation_t*, char* s, char* p, char* o, char* c);
+    /* Adds n statements in one write, c being NULL for none in a
+     * context.  Unlike add, any number of threads may call this at once,
+     * with pipelined writes, and alongside the writer.  Fails within
+     * the calling thread's batch or a bulk load. */
+    int (*add_many)(struct implementation_t*, int n, char** s, char** p,
+		    char** o, char** c);
     int (*remove)(struct implementation_t*, char* s, char* p, char* o, char* c);
+    /* Removes every statement in the context c. */
+    int (*remove_context)(struct implementation_t*, char* c);
     int (*contains)(struct implementation_t*, char* s, char* p, char* o,
 		    char* c);
+    /* Sets bit i of found (bit i % 8 of byte i / 8) if statement i is
+     * in the store. */
+    int (*contains_many)(struct implementation_t*, int n, char** s,
+			 char** p, char** o, char** c, unsigned char* found);
     struct implementation_stream_t* (*new_stream)(struct implementation_t *,
 						  char*, char*, char*, char*);
+    /* Streams the statements matching each of n patterns, whose bound
+     * terms are given by those of s, p and o which aren't NULL, in
+     * context c.  The patterns are scanned in key order by one
+     * iterator, and get_index gives the pattern a statement matches. */
+    struct implementation_stream_t* (*new_multi_stream)(
+	struct implementation_t *, int n, char** s, char** p, char** o,
+	char* c);
+    /* Evaluates the n patterns given by s, p and o as a basic graph
+     * pattern over the statements of every graph.  A term starting '?'
+     * is a variable, numbered in order of first appearance; others are
+     * bound terms.  Solutions come out sorted by the first variable
+     * the join binds. */
+    struct implementation_bindings_t* (*new_join)(struct implementation_t *,
+						  int n, char** s, char** p,
+						  char** o);
+    /* Estimates the number of statements new_stream would return for
+     * the same pattern, cheaply enough to order query patterns by.
+     * Returns -1 on error. */
+    int64_t (*estimate)(struct implementation_t*, char* s, char* p, char* o,
+			char* c);
+    /* Counts the statements new_stream would return for the same
+     * pattern, without reading their terms.  Returns -1 on error. */
+    int64_t (*count)(struct implementation_t*, char* s, char* p, char* o,
+		     char* c);
+    /* Iterates over the distinct subjects, predicates, objects or
+     * contexts in the store. */
+    struct implementation_terms_t* (*distinct_terms)(struct implementation_t*,
+						     term_part part);
+    /* Writes the store's triples as N-Triples to up to n files, named
+     * prefix, a four-digit shard number and ".nt", on a thread each.
+     * The shards split SPO order, so in number order they list the
+     * triples in that order.  Returns the number of files written, or -1
+     * on error. */
+    int (*export_triples)(struct implementation_t*, const char* prefix,
+			  int n);
+    int (*begin_batch)(struct implementation_t*);
+    int (*commit_batch)(struct implementation_t*);
+    int (*rollback_batch)(struct implementation_t*);
+    int (*begin_bulk)(struct implementation_t*);
+    int (*end_bulk)(struct implementation_t*);
+    /* The calling thread's reads between these see one consistent
+     * snapshot of the store, and reuse iterators.  Scopes nest. */
+    int (*begin_read)(struct implementation_t*);
+    int (*end_read)(struct implementation_t*);
+    /* Makes every write so far durable, whatever the durability mode. */
+    int (*sync)(struct implementation_t*);
     void* store;
 };
 
@@ -21,6 +106,9 @@ struct implementation_stream_t {
     int (*get_s)(struct implementation_stream_t*, const char**, size_t*);
     int (*get_p)(struct implementation_stream_t*, const char**, size_t*);
     int (*get_o)(struct implementation_stream_t*, const char**, size_t*);
+    /* Index of the pattern the statement matches, in a multi-pattern
+     * stream, else 0. */
+    int (*get_index)(struct implementation_stream_t*);
     int (*at_end)(struct implementation_stream_t*);
     int (*next)(struct implementation_stream_t*);
     void* stream;
@@ -28,5 +116,58 @@ struct implementation_stream_t {
 
 typedef struct implementation_stream_t implementation_stream;
 
-extern implementation* implementation_new(char* name, int sync, int is_new);
+struct implementation_terms_t {
+    implementation* impl;
+    void (*free)(struct implementation_terms_t*);
+    int (*get)(struct implementation_terms_t*, const char**, size_t*);
+    int (*at_end)(struct implementation_terms_t*);
+    int (*next)(struct implementation_terms_t*);
+    void* terms;
+};
+
+typedef struct implementation_terms_t implementation_terms;
+
+struct implementation_bindings_t {
+    implementation* impl;
+    void (*free)(struct implementation_bindings_t*);
+    /* Number of variables, and the name of variable i, without its '?'. */
+    int (*variables)(struct implementation_bindings_t*);
+    const char* (*variable)(struct implementation_bindings_t*, int i);
+    /* Value of variable i in the current solution. */
+    int (*get)(struct implementation_bindings_t*, int i, const char**,
+	       size_t*);
+    int (*at_end)(struct implementation_bindings_t*);
+    int (*next)(struct implementation_bindings_t*);
+    void* bindings;
+};
+
+typedef struct implementation_bindings_t implementation_bindings;
+
+struct implementation_options_t {
+    durability_mode durability;
+    /* Milliseconds between WAL syncs in group mode, 0 for default. */
+    unsigned int sync_interval;
+    int is_new;
+    /* Non-zero to pipeline writes, for threads calling add_many at once. */
+    int pipelined_writes;
+    open_mode mode;
+    /* Directory for a secondary's own files, NULL for a default. */
+    const char* secondary_path;
+    /* Milliseconds between a secondary's catch-ups, 0 for default. */
+    unsigned int catch_up_interval;
+    size_t cache_size;   /* Block cache size in bytes, 0 for default. */
+    /* RocksDB settings: a path to an OPTIONS file, then option strings
+     * for the database, for every column family, and for column
+     * families by name, as "spo={...};pos={...}".  Each overrides those
+     * before it.  NULL for none. */
+    const char* options_file;
+    const char* db_options;
+    const char* cf_options;
+    const char* family_options;
+};
+
+typedef struct implementation_options_t implementation_options;
+
+extern implementation* implementation_new(char* name,
+					  implementation_options* options);
 